@@ -11,6 +11,9 @@
 // Compile with 
 //	gcc IQ_ir.c -oIQ_ir -lwiringPi -lasound -llirc_client
 //
+// For multi-room volume/mute sync compile with
+//	gcc -DIQ_SYNC IQ_ir.c IQ_sync.c -oIQ_ir -lwiringPi -lasound -llirc_client
+// and run as IQ_ir [multicast group [port]]
 //
 
 #include <stdio.h>
@@ -22,6 +25,11 @@
 
 #include <errno.h>
 #include <string.h>
+
+#ifdef IQ_SYNC
+#include <fcntl.h>
+#include "IQ_sync.h"
+#endif
 /*
    IR Sensor onnections
    IRSensor	  - gpio 25   (IQAUDIO.COM PI-DAC 25)
@@ -44,6 +52,20 @@
 
 static volatile int buttonTimer;
 
+#ifdef IQ_SYNC
+// Another room changed volume/mute, apply it to our mixer
+static void syncApply(void *ctx, int field, long value)
+{
+   snd_mixer_elem_t *elem = ctx;
+   int x;
+
+   if (field == IQ_SYNC_VOLUME) x = snd_mixer_selem_set_playback_volume_all(elem, value);
+   else x = snd_mixer_selem_set_playback_switch_all(elem, value ? 0 : 1);
+
+   if (x) printf(" ERROR %d %s\n", x, snd_strerror(x));
+   else if (DEBUG_PRINT) printf(" Sync set field %d to %ld\n", field, value);
+}
+#endif
 
 
 
@@ -70,6 +92,7 @@ int main(int argc, char * argv[])
    char *c;
    int IRVALID = IQTRUE;
    int MUTESETTING = IQFALSE;
+   int VOLUMESET;
    int ival;
 
    printf("IQaudIO.com Pi-DAC Volume Control support (IR) v1.4 March 7th 2016\n\n");
@@ -110,9 +133,21 @@ int main(int argc, char * argv[])
    }
    else if (DEBUG_PRINT) printf("Current ALSA volume RIGHT: %ld\n", currentVolume);
 
+#ifdef IQ_SYNC
+   // Share volume/mute changes with the other rooms, carry on locally if that fails
+   struct iq_sync sync;
+   iq_sync_open(&sync, argc > 1 ? argv[1] : IQ_SYNC_GROUP, argc > 2 ? atoi(argv[2]) : IQ_SYNC_PORT,
+                NULL, syncApply, elem);
+#endif
+
    //Initiate LIRC. Exit on failure
-   if (lirc_init("lirc",1) !=-1)
+   if ((lirc_socket = lirc_init("lirc",1)) !=-1)
    {
+#ifdef IQ_SYNC
+	// Don't block in lirc_nextcode, we wait on the LIRC socket and the sync socket together
+	fcntl(lirc_socket, F_SETFL, fcntl(lirc_socket, F_GETFL) | O_NONBLOCK);
+#endif
+
 	//Read the default LIRC config at /etc/lirc/lircd.conf  This is the config for your remote.
  	if (lirc_readconfig(NULL,&config,NULL) !=0) IRVALID = IQFALSE;
 
@@ -125,9 +160,17 @@ int main(int argc, char * argv[])
         	{
  			//If code = NULL, meaning nothing was returned from LIRC socket,
                 	//then skip lines below and start while loop again.
-                	if(code==NULL) continue;
+                	if(code==NULL)
+			{
+#ifdef IQ_SYNC
+				// Apply other rooms' changes until the remote sends something
+				iq_sync_poll(&sync, -1, lirc_socket);
+#endif
+				continue;
+			}
 			{
 				if (DEBUG_PRINT) printf(" Some IR signal received: %s\n",code);
+				VOLUMESET = IQFALSE;
 
                         	   // Check to see if the string "KEY_MUTE" appears anywhere within the string 'code'.
 	                           if(strstr (code,"KEY_PLAYPAUSE"))
@@ -153,6 +196,9 @@ int main(int argc, char * argv[])
                                                 printf(" ERROR %d %s\n", x, snd_strerror(x));
                                         }
 					if (DEBUG_PRINT) printf("Toggle Mute - Mute state now %02x\n", ival ? 1 : 0);
+#ifdef IQ_SYNC
+					iq_sync_set(&sync, IQ_SYNC_MUTE, ival ? 1 : 0);
+#endif
 					buttonTimer = buttonTimer + 100;
                                    }
                                    else if(strstr (code,"KEY_VOLUMEUP"))
@@ -176,6 +222,7 @@ int main(int argc, char * argv[])
                       			// Adjust for MAX volume
                          		if (currentVolume > max) currentVolume = max;
                                         buttonTimer = buttonTimer + 100;
+                                        VOLUMESET = IQTRUE;
                                    }
                                    else if(strstr (code,"KEY_VOLUMEDOWN"))
 				   {
@@ -196,13 +243,21 @@ int main(int argc, char * argv[])
                       			// Adjust for MUTE
                          		if (currentVolume < min) currentVolume = 0;
                                         buttonTimer = buttonTimer + 100;
+                                        VOLUMESET = IQTRUE;
                                    }
 
-				   // Handle MUTE based on MUTESETTING
-	              		   if (x = snd_mixer_selem_set_playback_volume_all(elem, currentVolume))
-        	      		   {
-                	     		printf(" ERROR %d %s\n", x, snd_strerror(x));
-              			   } else if (DEBUG_PRINT) printf(" Volume successfully set to %ld using ALSA!\n", currentVolume);
+				   // Only the volume keys set the volume, currentVolume is stale after
+				   // any other key (alsamixer or another room may have changed it)
+				   if (VOLUMESET)
+				   {
+	              		   	if (x = snd_mixer_selem_set_playback_volume_all(elem, currentVolume))
+        	      		   	{
+                	     			printf(" ERROR %d %s\n", x, snd_strerror(x));
+              			   	} else if (DEBUG_PRINT) printf(" Volume successfully set to %ld using ALSA!\n", currentVolume);
+#ifdef IQ_SYNC
+				   	iq_sync_set(&sync, IQ_SYNC_VOLUME, currentVolume);
+#endif
+				   }
                 	} // No IR code received
 		} // while
    	} // IRVALID
@@ -211,6 +266,9 @@ int main(int argc, char * argv[])
 
 
    // We never get here but should close the sockets etc. on exit.
+#ifdef IQ_SYNC
+   iq_sync_close(&sync);
+#endif
    snd_mixer_close(handle);
 
    //Frees the data structures associated with config.
@@ -8,6 +8,10 @@
 //
 // Compile with gcc IQ_rot.c -oIQ_rot -lwiringPi -lasound
 //
+// For multi-room volume sync compile with
+//	gcc -DIQ_SYNC IQ_rot.c IQ_sync.c -oIQ_rot -lwiringPi -lasound
+// and run as IQ_rot [multicast group [port]]
+//
 // Make sure you have the most upto date WiringPi installed on the Pi to be used.
 
 
@@ -22,6 +26,10 @@
 #include <errno.h>
 #include <string.h>
 
+#ifdef IQ_SYNC
+#include "IQ_sync.h"
+#endif
+
 /*
    Rotary encoder connections:
    Encoder A      - gpio 23   (IQAUDIO.COM PI-DAC 23)
@@ -48,6 +56,21 @@ static volatile int inCriticalSection = FALSE;
 /* forward declaration */
 void encoderPulse();
 
+#ifdef IQ_SYNC
+// Another room changed volume/mute, apply it to our mixer
+static void syncApply(void *ctx, int field, long value)
+{
+   snd_mixer_elem_t *elem = ctx;
+   int x;
+
+   if (field == IQ_SYNC_VOLUME) x = snd_mixer_selem_set_playback_volume_all(elem, value);
+   else x = snd_mixer_selem_set_playback_switch_all(elem, value ? 0 : 1);
+
+   if (x) printf(" ERROR %d %s\n", x, snd_strerror(x));
+   else if (DEBUG_PRINT) printf(" Sync set field %d to %ld\n", field, value);
+}
+#endif
+
 
 int main(int argc, char * argv[])
 {
@@ -108,6 +131,13 @@ int main(int argc, char * argv[])
    }
    else if (DEBUG_PRINT) printf("Current ALSA volume RIGHT: %ld\n", currentVolume);
 
+#ifdef IQ_SYNC
+   // Share volume changes with the other rooms, carry on locally if that fails
+   struct iq_sync sync;
+   iq_sync_open(&sync, argc > 1 ? argv[1] : IQ_SYNC_GROUP, argc > 2 ? atoi(argv[2]) : IQ_SYNC_PORT,
+                NULL, syncApply, elem);
+#endif
+
 
    /* monitor encoder level changes */
    wiringPiISR (ENCODER_A, INT_EDGE_BOTH, &encoderPulse);
@@ -157,13 +187,23 @@ int main(int argc, char * argv[])
               {
                      printf(" ERROR %d %s\n", x, snd_strerror(x));
               } else if (DEBUG_PRINT) printf(" Volume successfully set to %ld using ALSA!\n", currentVolume);
+#ifdef IQ_SYNC
+	      iq_sync_set(&sync, IQ_SYNC_VOLUME, currentVolume);
+#endif
 	}
 
 	// Check x times per second, MAY NEED TO ADJUST THS FREQUENCY FOR SOME ENCODERS */
+#ifdef IQ_SYNC
+	iq_sync_poll(&sync, gpiodelay_value, -1); /* check pos x times per second, applying other rooms' changes meanwhile */
+#else
 	delay(gpiodelay_value); /* check pos x times per second */
+#endif
    }
 
    // We never get here but should close the sockets etc. on exit.
+#ifdef IQ_SYNC
+   iq_sync_close(&sync);
+#endif
    snd_mixer_close(handle);
 }
 
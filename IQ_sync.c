@@ -0,0 +1,421 @@
+// Multi-room volume/mute sync - IQ_sync.c
+//
+// Turns local volume/mute changes into small sequence-numbered packets sent
+// to a UDP multicast group, and applies peers' packets to the local mixer.
+//
+// - Changes are coalesced per frame (IQ_SYNC_FRAME_MS): spinning a knob sends
+//   at most one packet per frame holding the latest value, and the first
+//   change after an idle period goes out immediately.
+// - A packet only carries the fields that changed. Values are absolute, so a
+//   lost or repeated packet can never make rooms drift apart.
+// - Conflicts are last-writer-wins: each field carries a Lamport clock and the
+//   writer's node id, the highest (clock, node) pair wins everywhere.
+// - State is re-announced every IQ_SYNC_REFRESH_MS to repair lost packets.
+// - A new room sends an empty "hello" packet, the rooms that know some state
+//   answer with a refresh within IQ_SYNC_HELLO_JITTER_MS. Local changes are held back until that answer (or
+//   IQ_SYNC_HELLO_MS) so they are stamped after the current state and win.
+//
+// Packet layout (network byte order):
+//   'I' 'Q' version count  node(32)  seq(32)
+//   count x { field(8)  clock(32)  writer(32)  value(32) }
+//
+// The header node is the sender, each entry names the node that made the
+// write, since a refresh also relays other rooms' writes.
+//
+// IQaudIO.com
+//
+// Build alongside IQ_rot.c / IQ_ir.c with -DIQ_SYNC, see their headers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "IQ_sync.h"
+
+// Define DEBUG_PRINT TRUE for output
+#define DEBUG_PRINT 0		// 1 debug messages, 0 none
+
+#define IQ_SYNC_VERSION		2
+#define IQ_SYNC_HEADER_LEN	12
+#define IQ_SYNC_ENTRY_LEN	13
+#define IQ_SYNC_PACKET_MAX	(IQ_SYNC_HEADER_LEN + IQ_SYNC_FIELDS * IQ_SYNC_ENTRY_LEN)
+
+
+/* forward declaration */
+static void SendHello(struct iq_sync *s);
+
+
+long iq_sync_now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static uint32_t
+NewNodeId(void)
+{
+   uint32_t node = 0;
+   int fd;
+
+   fd = open("/dev/urandom", O_RDONLY);
+   if (fd != -1)
+   {
+      if (read(fd, &node, sizeof(node)) != sizeof(node)) node = 0;
+      close(fd);
+   }
+   if (node == 0) node = (uint32_t)getpid() ^ (uint32_t)time(NULL) ^ (uint32_t)iq_sync_now_ms();
+   return node ? node : 1;
+}
+
+static void
+Put32(unsigned char *p, uint32_t v)
+{
+   v = htonl(v);
+   memcpy(p, &v, 4);
+}
+
+static uint32_t
+Get32(const unsigned char *p)
+{
+   uint32_t v;
+
+   memcpy(&v, p, 4);
+   return ntohl(v);
+}
+
+int iq_sync_open(struct iq_sync *s, const char *group, int port, const char *ifaddr,
+                 iq_sync_apply_fn apply, void *ctx)
+{
+   struct ip_mreq mreq;
+   struct in_addr ifa;
+   unsigned char ttl = 1, loop = 1;
+   int on = 1;
+
+   memset(s, 0, sizeof(*s));
+   s->sock = -1;
+   s->apply = apply;
+   s->ctx = ctx;
+   s->node = NewNodeId();
+   s->last_tx_ms = iq_sync_now_ms() - IQ_SYNC_FRAME_MS;
+   s->last_refresh_ms = s->hello_ms = iq_sync_now_ms();
+
+   s->group.sin_family = AF_INET;
+   s->group.sin_port = htons(port);
+   ifa.s_addr = htonl(INADDR_ANY);
+   if (inet_pton(AF_INET, group, &s->group.sin_addr) != 1 ||
+       (ifaddr && inet_pton(AF_INET, ifaddr, &ifa) != 1))
+   {
+      fprintf(stderr, "IQ_sync: bad address %s / %s\n", group, ifaddr ? ifaddr : "any");
+      return(-1);
+   }
+
+   s->sock = socket(AF_INET, SOCK_DGRAM, 0);
+   if (s->sock == -1)
+   {
+      fprintf(stderr, "IQ_sync: socket failed: %s\n", strerror(errno));
+      return(-1);
+   }
+
+   // Several instances may share the port on one machine
+   setsockopt(s->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+   mreq.imr_multiaddr = s->group.sin_addr;
+   mreq.imr_interface = ifa;
+
+   if (bind(s->sock, (struct sockaddr *)&s->group, sizeof(s->group)) == -1 ||
+       setsockopt(s->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1 ||
+       setsockopt(s->sock, IPPROTO_IP, IP_MULTICAST_IF, &ifa, sizeof(ifa)) == -1 ||
+       setsockopt(s->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1 ||
+       setsockopt(s->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1 ||
+       fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK) == -1)
+   {
+      fprintf(stderr, "IQ_sync: joining %s:%d failed: %s\n", group, port, strerror(errno));
+      close(s->sock);
+      s->sock = -1;
+      return(-1);
+   }
+
+   if (DEBUG_PRINT) printf("IQ_sync: node %08x joined %s:%d\n", s->node, group, port);
+   SendHello(s);
+   return(0);
+}
+
+void iq_sync_close(struct iq_sync *s)
+{
+   if (s->sock != -1) close(s->sock);
+   s->sock = -1;
+}
+
+void iq_sync_set(struct iq_sync *s, int field, long value)
+{
+   struct iq_sync_field *f;
+
+   if (field < 0 || field >= IQ_SYNC_FIELDS) return;
+
+   f = &s->fields[field];
+   if ((f->stamp || f->pending) && f->value == value) return;
+
+   f->value = value;
+   f->pending = 1;
+}
+
+// Fill in the header and send, buf holds count entries up to end
+static int
+SendPacket(struct iq_sync *s, unsigned char *buf, unsigned char *end, int count)
+{
+   buf[0] = 'I';
+   buf[1] = 'Q';
+   buf[2] = IQ_SYNC_VERSION;
+   buf[3] = count;
+   Put32(buf + 4, s->node);
+   Put32(buf + 8, ++s->seq);
+
+   if (sendto(s->sock, buf, end - buf, 0, (struct sockaddr *)&s->group, sizeof(s->group)) == -1)
+   {
+      if (DEBUG_PRINT) printf("IQ_sync: send failed: %s\n", strerror(errno));
+      return(-1);
+   }
+
+   s->stats.tx_packets++;
+   return(1);
+}
+
+// An empty packet asks the other rooms for their state
+static void
+SendHello(struct iq_sync *s)
+{
+   unsigned char buf[IQ_SYNC_HEADER_LEN];
+
+   SendPacket(s, buf, buf + IQ_SYNC_HEADER_LEN, 0);
+}
+
+// Send the pending fields, or every known field when refreshing
+static int
+SendFrame(struct iq_sync *s, int refresh)
+{
+   unsigned char buf[IQ_SYNC_PACKET_MAX];
+   unsigned char *p = buf + IQ_SYNC_HEADER_LEN;
+   int i, count = 0;
+
+   if (s->sock == -1) return(0);
+
+   for (i = 0; i < IQ_SYNC_FIELDS; i++)
+   {
+      struct iq_sync_field *f = &s->fields[i];
+
+      if (!(f->pending || (refresh && f->stamp))) continue;
+
+      // Stamping at send time puts the write after everything heard so far
+      if (f->pending)
+      {
+         f->stamp = ++s->clock;
+         f->node = s->node;
+      }
+
+      p[0] = i;
+      Put32(p + 1, f->stamp);
+      Put32(p + 5, f->node);
+      Put32(p + 9, (uint32_t)(int32_t)f->value);
+      p += IQ_SYNC_ENTRY_LEN;
+      count++;
+   }
+   if (count == 0) return(0);
+
+   // Everything pending has now been stamped and announced
+   for (i = 0; i < IQ_SYNC_FIELDS; i++) s->fields[i].pending = 0;
+   return(SendPacket(s, buf, p, count));
+}
+
+// Track each peer's sequence number to count gaps (lost or reordered packets)
+static void
+TrackPeer(struct iq_sync *s, uint32_t node, uint32_t seq)
+{
+   int i;
+
+   for (i = 0; i < s->npeers; i++)
+   {
+      if (s->peers[i].node != node) continue;
+
+      if ((int32_t)(seq - s->peers[i].seq) > 1) s->stats.rx_gaps += seq - s->peers[i].seq - 1;
+      if ((int32_t)(seq - s->peers[i].seq) > 0) s->peers[i].seq = seq;
+      return;
+   }
+
+   // New peer, the oldest entry makes way when the table is full
+   if (s->npeers == IQ_SYNC_MAX_PEERS)
+   {
+      memmove(&s->peers[0], &s->peers[1], (IQ_SYNC_MAX_PEERS - 1) * sizeof(s->peers[0]));
+      s->npeers--;
+   }
+   s->peers[s->npeers].node = node;
+   s->peers[s->npeers].seq = seq;
+   s->npeers++;
+}
+
+static void
+HandlePacket(struct iq_sync *s, const unsigned char *buf, int len)
+{
+   uint32_t node, writer, stamp;
+   int i, count, field, known;
+   long value, due;
+
+   if (len < IQ_SYNC_HEADER_LEN || buf[0] != 'I' || buf[1] != 'Q' || buf[2] != IQ_SYNC_VERSION) return;
+
+   count = buf[3];
+   node = Get32(buf + 4);
+   if (node == s->node) return;		// Our own packet looped back
+   if (len < IQ_SYNC_HEADER_LEN + count * IQ_SYNC_ENTRY_LEN) return;
+
+   s->stats.rx_packets++;
+   TrackPeer(s, node, Get32(buf + 8));
+
+   // A new room said hello, answer with a refresh shortly if we know anything.
+   // Rooms that don't stay quiet, the newcomer's IQ_SYNC_HELLO_MS covers that
+   if (count == 0)
+   {
+      for (i = 0; i < IQ_SYNC_FIELDS; i++)
+      {
+         if (!s->fields[i].stamp) continue;
+
+         // Jitter by node id so the answers don't all land at once
+         due = iq_sync_now_ms() + s->node % IQ_SYNC_HELLO_JITTER_MS;
+         if (due - IQ_SYNC_REFRESH_MS < s->last_refresh_ms) s->last_refresh_ms = due - IQ_SYNC_REFRESH_MS;
+         break;
+      }
+      return;
+   }
+   s->synced = 1;
+
+   for (i = 0; i < count; i++)
+   {
+      const unsigned char *p = buf + IQ_SYNC_HEADER_LEN + i * IQ_SYNC_ENTRY_LEN;
+      struct iq_sync_field *f;
+
+      field = p[0];
+      stamp = Get32(p + 1);
+      writer = Get32(p + 5);
+      value = (int32_t)Get32(p + 9);
+      if (field >= IQ_SYNC_FIELDS) continue;
+
+      if (stamp > s->clock) s->clock = stamp;
+
+      // A local change not sent yet will be stamped after this one anyway
+      f = &s->fields[field];
+      if (f->pending) continue;
+
+      // Last writer wins, node id breaks ties between simultaneous writes
+      if (stamp < f->stamp || (stamp == f->stamp && writer <= f->node)) continue;
+
+      known = f->stamp != 0;
+      f->stamp = stamp;
+      f->node = writer;
+      if (f->value != value || !known)
+      {
+         f->value = value;
+         s->stats.rx_applied++;
+         if (DEBUG_PRINT) printf("IQ_sync: node %08x set field %d to %ld\n", writer, field, value);
+         if (s->apply) s->apply(s->ctx, field, value);
+      }
+   }
+}
+
+#ifdef IQ_SYNC_TEST
+// Hand a packet to HandlePacket, dropping/reordering it if the benchmark asked
+static void
+ReceivePacket(struct iq_sync *s, const unsigned char *buf, int len)
+{
+   s->test_rx++;
+   if (s->test_drop_every && s->test_rx % s->test_drop_every == 0) return;
+   if (s->test_swap_every && s->test_rx % s->test_swap_every == 0 && !s->test_held_len)
+   {
+      memcpy(s->test_held, buf, len);
+      s->test_held_len = len;
+      return;
+   }
+
+   HandlePacket(s, buf, len);
+   if (s->test_held_len)
+   {
+      HandlePacket(s, s->test_held, s->test_held_len);
+      s->test_held_len = 0;
+   }
+}
+#else
+#define ReceivePacket(s, buf, len)	HandlePacket(s, buf, len)
+#endif
+
+int iq_sync_poll(struct iq_sync *s, int timeout_ms, int extra_fd)
+{
+   unsigned char buf[IQ_SYNC_RX_MAX];
+   struct pollfd fds[2];
+   long now, end, next, due;
+   int i, len, pending, known, wait;
+
+   end = iq_sync_now_ms() + timeout_ms;
+
+   while (1)
+   {
+      now = iq_sync_now_ms();
+      if (now - s->hello_ms >= IQ_SYNC_HELLO_MS) s->synced = 1;
+
+      // Without a socket there is nothing to send, just wait
+      pending = known = 0;
+      for (i = 0; s->sock != -1 && i < IQ_SYNC_FIELDS; i++)
+      {
+         if (s->fields[i].pending) pending = 1;
+         if (s->fields[i].stamp) known = 1;
+      }
+
+      // Send what is due, a new frame takes the place of a refresh
+      if (pending && s->synced && now - s->last_tx_ms >= IQ_SYNC_FRAME_MS)
+      {
+         SendFrame(s, 0);
+         s->last_tx_ms = now;
+         pending = 0;
+      }
+      else if (known && now - s->last_refresh_ms >= IQ_SYNC_REFRESH_MS)
+      {
+         SendFrame(s, 1);
+         s->last_tx_ms = s->last_refresh_ms = now;
+      }
+
+      // Sleep until traffic, the caller's timeout or our next send
+      next = timeout_ms < 0 ? -1 : end;
+      if (pending)
+      {
+         due = s->synced ? s->last_tx_ms + IQ_SYNC_FRAME_MS : s->hello_ms + IQ_SYNC_HELLO_MS;
+         if (next < 0 || due < next) next = due;
+      }
+      if (known && (next < 0 || s->last_refresh_ms + IQ_SYNC_REFRESH_MS < next)) next = s->last_refresh_ms + IQ_SYNC_REFRESH_MS;
+      wait = next < 0 ? -1 : (next > now ? (int)(next - now) : 0);
+
+      fds[0].fd = s->sock;
+      fds[0].events = POLLIN;
+      fds[1].fd = extra_fd;
+      fds[1].events = POLLIN;
+      fds[0].revents = fds[1].revents = 0;
+
+      if (poll(fds, extra_fd >= 0 ? 2 : 1, wait) == -1)
+      {
+         if (errno == EINTR) continue;
+         return(-1);
+      }
+
+      if (fds[0].revents & POLLIN)
+      {
+         while ((len = recv(s->sock, buf, sizeof(buf), 0)) > 0) ReceivePacket(s, buf, len);
+      }
+
+      if (extra_fd >= 0 && fds[1].revents) return(1);
+      if (timeout_ms >= 0 && iq_sync_now_ms() >= end) return(0);
+   }
+}
@@ -0,0 +1,112 @@
+// Multi-room volume/mute sync - IQ_sync.h
+//
+// Shares local volume/mute changes between IQaudIO Pis over UDP multicast.
+// See IQ_sync.c for the packet format and compile instructions.
+//
+// IQaudIO.com
+
+#ifndef IQ_SYNC_H
+#define IQ_SYNC_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Default multicast group/port, administratively scoped so it stays on site
+#define IQ_SYNC_GROUP		"239.255.42.42"
+#define IQ_SYNC_PORT		5510
+
+// Local changes are coalesced and sent at most once per frame
+#define IQ_SYNC_FRAME_MS	10
+// Current state is re-announced this often so lost packets/new rooms catch up
+#define IQ_SYNC_REFRESH_MS	2000
+// A new room asks for the current state and holds its own changes back this
+// long, so its first change is stamped after what the other rooms already hold
+#define IQ_SYNC_HELLO_MS	100
+// Rooms spread their answers to a hello over this long, by node id
+#define IQ_SYNC_HELLO_JITTER_MS	20
+
+#define IQ_SYNC_MAX_PEERS	16
+#define IQ_SYNC_RX_MAX		256
+
+// Fields carried in a packet
+#define IQ_SYNC_VOLUME		0
+#define IQ_SYNC_MUTE		1
+#define IQ_SYNC_FIELDS		2
+
+// Called when a peer's change wins and must be applied to the local mixer
+typedef void (*iq_sync_apply_fn)(void *ctx, int field, long value);
+
+struct iq_sync_field
+{
+   uint32_t stamp;		// Lamport clock of the last write, 0 = never written
+   uint32_t node;		// Node that made the last write
+   long value;
+   int pending;			// Changed locally, stamped when the next packet goes out
+};
+
+struct iq_sync_peer
+{
+   uint32_t node;
+   uint32_t seq;
+};
+
+struct iq_sync_stats
+{
+   unsigned long tx_packets;
+   unsigned long rx_packets;
+   unsigned long rx_applied;	// Entries that won and were applied
+   unsigned long rx_gaps;	// Sequence numbers skipped by peers' packets, lost or
+				// just reordered, a late packet is not taken back off
+};
+
+struct iq_sync
+{
+   int sock;
+   struct sockaddr_in group;
+   uint32_t node;
+   uint32_t seq;
+   uint32_t clock;
+
+   struct iq_sync_field fields[IQ_SYNC_FIELDS];
+   struct iq_sync_peer peers[IQ_SYNC_MAX_PEERS];
+   int npeers;
+
+   long last_tx_ms;
+   long last_refresh_ms;
+   long hello_ms;
+   int synced;			// Peers' state received, or nobody answered the hello
+
+   iq_sync_apply_fn apply;
+   void *ctx;
+
+   struct iq_sync_stats stats;
+
+#ifdef IQ_SYNC_TEST
+   // Loopback benchmark only: ignore every Nth received packet and hold every
+   // Mth back until the next one has been handled, 0 turns them off
+   int test_drop_every;
+   int test_swap_every;
+   unsigned long test_rx;
+   unsigned char test_held[IQ_SYNC_RX_MAX];
+   int test_held_len;
+#endif
+};
+
+// Join group:port. ifaddr selects the interface (NULL for the default route,
+// "127.0.0.1" to keep several instances on one machine). Returns 0 or -1,
+// on failure the instance stays usable but only sleeps in iq_sync_poll.
+int iq_sync_open(struct iq_sync *s, const char *group, int port, const char *ifaddr,
+                 iq_sync_apply_fn apply, void *ctx);
+void iq_sync_close(struct iq_sync *s);
+
+// Record a local change, it goes out with the next frame
+void iq_sync_set(struct iq_sync *s, int field, long value);
+
+// Send any due frame/refresh and apply peers' packets, waiting at most
+// timeout_ms (-1 forever) for traffic. If extra_fd >= 0 it is waited on too.
+// Returns 1 when extra_fd is readable, 0 on timeout, -1 on error.
+int iq_sync_poll(struct iq_sync *s, int timeout_ms, int extra_fd);
+
+long iq_sync_now_ms(void);
+
+#endif
@@ -0,0 +1,257 @@
+// Multi-room sync loopback benchmark - IQ_sync_bench.c
+//
+// Runs several IQ_sync instances on this machine over the loopback interface,
+// each driving a dummy mixer instead of ALSA, and reports packet rates and how
+// long the rooms take to agree.
+//
+//   spin     - one room spins its knob (one volume step per ms), the rest follow
+//   conflict - two rooms change volume/mute at the same moment, all must agree
+//   lossy    - a spin, then three rooms change volume/mute at the same moment,
+//              while every room but the first drops and reorders packets. Runs
+//              past one refresh period so lost writes must be repaired by it
+//   late     - one room starts after the others have set the volume and changes
+//              it straight away, its change must win
+//
+// Exits non zero if any scenario fails to converge, takes longer than
+// CONVERGE_MS to agree (lossy may wait for a refresh), or if the spinning room
+// sends more than one packet per frame while the rooms following it send any.
+//
+// IQaudIO.com
+//
+// Compile with gcc -DIQ_SYNC_TEST IQ_sync_bench.c IQ_sync.c -oIQ_sync_bench
+// (IQ_SYNC_TEST builds the packet loss/reordering hooks into IQ_sync.c)
+//
+// Run with ./IQ_sync_bench [instances] [port]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "IQ_sync.h"
+
+#ifndef IQ_SYNC_TEST
+#error "Compile with -DIQ_SYNC_TEST, see the header"
+#endif
+
+#define MAX_INSTANCES	16
+#define SPIN_STEPS	200		// Volume steps sent by the spinning room
+#define SPIN_STEP_MS	1
+#define SETTLE_MS	500		// Time allowed for the rooms to agree
+#define START_DELAY_MS	200		// Lets every instance join before the clock starts
+#define LATE_MS		300		// When the late room starts
+#define CONVERGE_MS	50		// Rooms must agree this soon after the last change
+#define FRAME_SLACK	2		// Extra packets allowed over one per frame
+
+#define SCENARIO_SPIN		0
+#define SCENARIO_CONFLICT	1
+#define SCENARIO_LOSSY		2
+#define SCENARIO_LATE		3
+
+// Stand-in for the ALSA "Digital" control
+struct dummy_mixer
+{
+   int id;
+   long volume;
+   long mute;
+   long last_local_ms;
+   long last_apply_ms;
+   unsigned long changes;		// Local changes made by this room
+   unsigned long tx_before;		// Packets sent before the scenario started (hello)
+   struct iq_sync_stats stats;
+};
+
+static void
+DummyApply(void *ctx, int field, long value)
+{
+   struct dummy_mixer *m = ctx;
+
+   if (field == IQ_SYNC_VOLUME) m->volume = value;
+   else m->mute = value;
+   m->last_apply_ms = iq_sync_now_ms();
+}
+
+static void
+DummySet(struct iq_sync *s, struct dummy_mixer *m, int field, long value)
+{
+   if (field == IQ_SYNC_VOLUME) m->volume = value;
+   else m->mute = value;
+   m->last_local_ms = iq_sync_now_ms();
+   m->changes++;
+   iq_sync_set(s, field, value);
+}
+
+// Keep the sync instance serviced until the given time
+static void
+RunUntil(struct iq_sync *s, long until)
+{
+   long now;
+
+   while ((now = iq_sync_now_ms()) < until) iq_sync_poll(s, until - now, -1);
+}
+
+static void
+Spin(struct iq_sync *s, struct dummy_mixer *m, long from)
+{
+   int i;
+
+   for (i = 1; i <= SPIN_STEPS; i++)
+   {
+      DummySet(s, m, IQ_SYNC_VOLUME, i);
+      RunUntil(s, from + i * SPIN_STEP_MS);
+   }
+}
+
+static int
+RunInstance(int id, int instances, int scenario, int port, long start, long end, int fd)
+{
+   struct dummy_mixer m;
+   struct iq_sync s;
+
+   memset(&m, 0, sizeof(m));
+   m.id = id;
+
+   if (scenario == SCENARIO_LATE && id == instances - 1)
+   {
+      usleep((start + LATE_MS - iq_sync_now_ms()) * 1000);
+      if (iq_sync_open(&s, IQ_SYNC_GROUP, port, "127.0.0.1", DummyApply, &m)) return(1);
+      DummySet(&s, &m, IQ_SYNC_VOLUME, 700);
+      RunUntil(&s, end);
+   }
+   else
+   {
+      if (iq_sync_open(&s, IQ_SYNC_GROUP, port, "127.0.0.1", DummyApply, &m)) return(1);
+      if (scenario == SCENARIO_LOSSY && id > 0)
+      {
+         s.test_drop_every = 2 + id;
+         s.test_swap_every = 3 + id;
+      }
+
+      RunUntil(&s, start);
+      m.tx_before = s.stats.tx_packets;
+
+      if ((scenario == SCENARIO_SPIN && id == 0) || (scenario == SCENARIO_LOSSY && id == 1)) Spin(&s, &m, start);
+      else if (scenario == SCENARIO_LATE) DummySet(&s, &m, IQ_SYNC_VOLUME, 300);
+
+      if (scenario == SCENARIO_LOSSY) RunUntil(&s, start + SPIN_STEPS * SPIN_STEP_MS + SETTLE_MS);
+
+      if ((scenario == SCENARIO_CONFLICT && id < 2) || (scenario == SCENARIO_LOSSY && id < 3))
+      {
+         DummySet(&s, &m, IQ_SYNC_VOLUME, 500 + id * 100);
+         DummySet(&s, &m, IQ_SYNC_MUTE, id & 1);
+      }
+
+      RunUntil(&s, end);
+   }
+
+   m.stats = s.stats;
+   iq_sync_close(&s);
+   return(write(fd, &m, sizeof(m)) == sizeof(m) ? 0 : 1);
+}
+
+// expect is the volume every room must end on, -1 when any agreed value will do
+static int
+RunScenario(const char *name, int scenario, int instances, int port, long expect)
+{
+   struct dummy_mixer m[MAX_INSTANCES];
+   unsigned long tx = 0, rx = 0, gaps = 0, changes = 0, spin_tx = 0, follow_tx = 0, frames;
+   long last_local = 0, last_apply = 0, active_ms, converge_ms;
+   int fds[2], i, status, converged = 1, ok;
+   long start, end;
+   pid_t pid;
+
+   if (pipe(fds)) return(1);
+   start = iq_sync_now_ms() + START_DELAY_MS;
+   end = start + SPIN_STEPS * SPIN_STEP_MS + SETTLE_MS;
+   if (scenario == SCENARIO_LOSSY) end += SETTLE_MS + IQ_SYNC_REFRESH_MS;
+   fflush(stdout);
+
+   for (i = 0; i < instances; i++)
+   {
+      pid = fork();
+      if (pid == 0)
+      {
+         close(fds[0]);
+         _exit(RunInstance(i, instances, scenario, port, start, end, fds[1]));
+      }
+      if (pid < 0) return(1);
+   }
+   close(fds[1]);
+
+   // Results arrive in completion order, the order does not matter here
+   for (i = 0; i < instances; i++)
+   {
+      if (read(fds[0], &m[i], sizeof(m[i])) != sizeof(m[i]))
+      {
+         fprintf(stderr, "%s: instance failed to report\n", name);
+         converged = 0;
+         instances = i;
+         break;
+      }
+   }
+   close(fds[0]);
+   while (wait(&status) > 0);
+
+   for (i = 0; i < instances; i++)
+   {
+      tx += m[i].stats.tx_packets;
+      if (m[i].id == 0) spin_tx = m[i].stats.tx_packets - m[i].tx_before;
+      else follow_tx += m[i].stats.tx_packets - m[i].tx_before;
+      rx += m[i].stats.rx_packets;
+      gaps += m[i].stats.rx_gaps;
+      changes += m[i].changes;
+      if (m[i].last_local_ms > last_local) last_local = m[i].last_local_ms;
+      if (m[i].last_apply_ms > last_apply) last_apply = m[i].last_apply_ms;
+      if (m[i].volume != m[0].volume || m[i].mute != m[0].mute) converged = 0;
+   }
+   if (expect >= 0 && m[0].volume != expect) converged = 0;
+   ok = converged;
+
+   printf("%-9s %d rooms: volume %ld mute %ld %s\n", name, instances, m[0].volume, m[0].mute,
+          converged ? "converged" : "DIVERGED");
+   printf("          %lu local changes sent as %lu packets, rx %lu, sequence gaps %lu\n", changes, tx, rx, gaps);
+
+   // A rate only means something while a knob is being spun, room 0 spins
+   if (scenario == SCENARIO_SPIN)
+   {
+      active_ms = last_local - start + 1;
+      frames = active_ms / IQ_SYNC_FRAME_MS + FRAME_SLACK;
+      printf("          spinning room sent %lu packets in %ld ms, %.0f/s%s\n", spin_tx, active_ms,
+             spin_tx * 1000.0 / active_ms, spin_tx > frames ? " TOO MANY" : "");
+      printf("          following rooms sent %lu packets%s\n", follow_tx, follow_tx ? " TOO MANY" : "");
+      if (spin_tx > frames || follow_tx) ok = 0;
+   }
+
+   // Only the lossy scenario may wait for a refresh to repair things
+   converge_ms = last_apply > last_local ? last_apply - last_local : 0;
+   printf("          convergence %ld ms after the last local change%s\n", converge_ms,
+          scenario != SCENARIO_LOSSY && converge_ms > CONVERGE_MS ? " TOO SLOW" : "");
+   if (scenario != SCENARIO_LOSSY && converge_ms > CONVERGE_MS) ok = 0;
+
+   return(ok ? 0 : 1);
+}
+
+int main(int argc, char * argv[])
+{
+   int instances = 4;
+   int port = IQ_SYNC_PORT + 1;		// Stay clear of real rooms on the default port
+   int failed = 0;
+
+   if (argc > 1) instances = atoi(argv[1]);
+   if (argc > 2) port = atoi(argv[2]);
+   if (instances < 2 || instances > MAX_INSTANCES)
+   {
+      fprintf(stderr, "instances must be 2..%d\n", MAX_INSTANCES);
+      return(1);
+   }
+
+   printf("IQaudIO.com multi-room sync loopback benchmark, frame %d ms\n\n", IQ_SYNC_FRAME_MS);
+
+   failed |= RunScenario("spin", SCENARIO_SPIN, instances, port, SPIN_STEPS);
+   failed |= RunScenario("conflict", SCENARIO_CONFLICT, instances, port, -1);
+   failed |= RunScenario("lossy", SCENARIO_LOSSY, instances, port, -1);
+   failed |= RunScenario("late", SCENARIO_LATE, instances, port, 700);
+
+   return(failed);
+}